@@ -13,6 +13,7 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
 
 
 // The game state can be used to detect what happens on the playfield
@@ -21,6 +22,17 @@
 #define ROW_CLEAR  (1 << 1)
 #define TILE_ADDED (1 << 2)
 
+// The joystick is drained with reads of JOYSTICK_EVENT_BATCH events, at most
+// JOYSTICK_MAX_READS times per tick, which bounds the input handling time
+#define JOYSTICK_EVENT_BATCH 64
+#define JOYSTICK_MAX_READS   4
+
+// Input recordings start with a replayHeader, followed by one record per key:
+// the tick delta to the previous record as LEB128 varint and the key as one byte
+#define REPLAY_MAGIC     0x43525453 // "STRC"
+#define REPLAY_VERSION   1
+#define REPLAY_MAX_DUMPS 64
+
 // If you extend this structure, either avoid pointers or adjust
 // the game logic allocate/deallocate and reset the memory
 typedef struct {
@@ -34,6 +46,33 @@ typedef struct {
   int color;
 } coord;
 
+// Keys collected from all joystick events queued during one tick
+typedef struct {
+  int last;   // most recent key pressed or repeated
+  bool enter; // KEY_ENTER was seen, overrides every other key
+} inputSet;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seed; // seed of the tile color generator
+} replayHeader;
+
+// State of the session recorder / player, ticks count main loop iterations
+typedef struct {
+  FILE *record;           // recording is written here, if set
+  FILE *playback;         // keys are read from here instead of the joystick, if set
+  bool fast;              // playback as fast as possible, no rendering and no sleeping
+  bool exhausted;         // playback reached the end of the recording
+  uint32_t seed;
+  unsigned long tick;     // current main loop tick
+  unsigned long lastTick; // tick of the last written or read record
+  unsigned long nextTick; // tick of the pending playback key
+  int nextKey;            // pending playback key
+  unsigned long dumps[REPLAY_MAX_DUMPS]; // ticks at which the playfield is dumped
+  unsigned int numDumps;
+} replayState;
+
 typedef struct {
   coord const grid;                     // playfield bounds
   unsigned long const uSecTickTime;     // tick rate
@@ -59,13 +98,18 @@ typedef struct {
 int colors[6] = {0xf800, 0xffe0, 0x07e0, 0x001f, 0xf81f, 0x07ff};
 
 u_int16_t framebufferfd;
-u_int16_t* framebuffer;
+u_int16_t* framebuffer = NULL;
 u_int32_t joystickfd;
-struct input_event event;
 
 coord active_tile;
 int c;
 
+// State of the tile color generator, xorshift32 so recordings replay
+// bit-exact independent of the C library's rand()
+uint32_t randState = 1;
+
+replayState replay = {0};
+
 gameConfig game = {
                    .grid = {8, 8},
                    .uSecTickTime = 10000,
@@ -113,7 +157,8 @@ bool initializeSenseHat() {
         return false;
       }
   /// Open the file descriptor for the joystick
-  joystickfd = open("/dev/input/event0", O_RDONLY);
+  /// Non-blocking, so the event queue can be drained until read() runs dry
+  joystickfd = open("/dev/input/event0", O_RDONLY | O_NONBLOCK);
   if (joystickfd < 0) {
     fprintf(stderr, "ERROR: could not open input device\n");
     return false;
@@ -124,37 +169,69 @@ bool initializeSenseHat() {
 // This function is called when the application exits
 // Here you can free up everything that you might have opened/allocated
 void freeSenseHat() {
+  if (!framebuffer)
+    return;
   munmap(framebuffer, 128);
   close(framebufferfd);
 }
 
+/// Maps a joystick key code to the key handed to the game logic
+static int joystickKey(unsigned short const code) {
+  switch (code) {
+    case KEY_UP:
+      return KEY_UP;
+    case KEY_DOWN:
+      return KEY_DOWN;
+    case KEY_LEFT:
+      return KEY_LEFT;
+    case KEY_RIGHT:
+      return KEY_RIGHT;
+    case KEY_ENTER:
+      return KEY_ENTER;
+    default:
+      return KEY_DOWN;
+  }
+}
+
+/// Drains every pending joystick event and coalesces them into one key for this tick.
+/// A single read() returns as many queued events as fit into the batch, so bursts of
+/// key repeats and EV_SYN reports no longer trickle in one event per tick.
+/// KEY_ENTER wins over everything else, otherwise the most recent press or repeat is used
 int handleJoystickInput(int joystickfd) {
-  read(joystickfd, &event, sizeof(event));
+  struct input_event events[JOYSTICK_EVENT_BATCH];
+  inputSet input = {0};
+  bool dropped = false;
 
-  int key = 0;
-  
-/// Checks if the joystick was moved from center to any direction, or held in any direction, ignores if the joystick is released to center
-  if (event.type == EV_KEY && (event.value == 1 || event.value == 2)) {
-    switch (event.code) {
-      case KEY_UP:
-        key = KEY_UP;
-      case KEY_DOWN:
-        key = KEY_DOWN;
-        break;
-      case KEY_LEFT:
-        key = KEY_LEFT;
-        break;
-      case KEY_RIGHT:
-        key = KEY_RIGHT;
-        break;
-      case KEY_ENTER:
-        key = KEY_ENTER;
-        break;
-      default:
-        key = KEY_DOWN;
+  for (int reads = 0; reads < JOYSTICK_MAX_READS; reads++) {
+    ssize_t const n = read(joystickfd, events, sizeof(events));
+    if (n < (ssize_t) sizeof(struct input_event))
+      break;
+
+    size_t const count = n / sizeof(struct input_event);
+    for (size_t i = 0; i < count; i++) {
+      struct input_event const *ev = &events[i];
+      /// After SYN_DROPPED the kernel queue overflowed, skip until the next complete report
+      if (ev->type == EV_SYN) {
+        if (ev->code == SYN_DROPPED)
+          dropped = true;
+        else if (ev->code == SYN_REPORT)
+          dropped = false;
+        continue;
+      }
+      /// Only presses (1) and repeats (2) count, releasing the joystick to center is ignored
+      if (dropped || ev->type != EV_KEY || (ev->value != 1 && ev->value != 2))
+        continue;
+      input.last = joystickKey(ev->code);
+      if (input.last == KEY_ENTER)
+        input.enter = true;
     }
+
+    /// A short read means the queue is empty
+    if (count < JOYSTICK_EVENT_BATCH)
+      break;
   }
-  return key;
+
+  return input.enter ? KEY_ENTER : input.last;
 }
 
 // This function should return the key that corresponds to the joystick press
@@ -179,7 +256,7 @@ int readSenseHatJoystick() {
 // has changed the playfield
 void renderSenseHatMatrix(bool const playfieldChanged) {
   (void) playfieldChanged;
-  if (!playfieldChanged)
+  if (!playfieldChanged || !framebuffer)
     return;
 
 
@@ -191,6 +268,8 @@ void renderSenseHatMatrix(bool const playfieldChanged) {
 }
 
 void resetMatrix() {
+  if (!framebuffer)
+    return;
   for (int i = 0; i < 64; i++) {
     framebuffer[i] = 0x0000;
   }
@@ -199,9 +278,16 @@ void resetMatrix() {
 // if you choose to change the playfield or the tile structure, you might need to
 // adjust this game logic <> playfield interface
 
+static inline uint32_t gameRand() {
+  randState ^= randState << 13;
+  randState ^= randState >> 17;
+  randState ^= randState << 5;
+  return randState;
+}
+
 static inline void newTile(coord const target) {
   game.playfield[target.y][target.x].occupied = true;
-  c = rand() % 7;
+  c = gameRand() % (sizeof(colors) / sizeof(colors[0]));
   
   /// Each playfield location gets a color assigned to it
   game.playfield[target.y][target.x].color = colors[c];
@@ -476,18 +562,203 @@ void renderConsole(bool const playfieldChanged) {
   fflush(stdout);
 }
 
+// Session recording and playback. Game logic only depends on the key of each tick
+// and the tile color generator, so replaying both reproduces a session bit-exact
+
+static void replayWriteVarint(FILE *file, unsigned long value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value)
+      byte |= 0x80;
+    fputc(byte, file);
+  } while (value);
+}
+
+static bool replayReadVarint(FILE *file, unsigned long *value) {
+  *value = 0;
+  for (unsigned int shift = 0; shift < 8 * sizeof(*value); shift += 7) {
+    int const byte = fgetc(file);
+    if (byte == EOF)
+      return false;
+    *value |= (unsigned long) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool replayStartRecording(char const *path) {
+  replay.record = fopen(path, "wb");
+  if (!replay.record) {
+    fprintf(stderr, "ERROR: could not open recording %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  replayHeader const header = {REPLAY_MAGIC, REPLAY_VERSION, replay.seed};
+  if (fwrite(&header, sizeof(header), 1, replay.record) != 1) {
+    fprintf(stderr, "ERROR: could not write recording %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+void replayRecordKey(int const key) {
+  if (!replay.record || !key)
+    return;
+  replayWriteVarint(replay.record, replay.tick - replay.lastTick);
+  fputc(key, replay.record);
+  replay.lastTick = replay.tick;
+}
+
+/// Reads the next record into nextTick/nextKey, marks the playback exhausted at the end
+static void replayReadNext() {
+  unsigned long delta;
+  int key;
+  if (!replayReadVarint(replay.playback, &delta) || (key = fgetc(replay.playback)) == EOF) {
+    replay.exhausted = true;
+    return;
+  }
+  replay.nextTick = replay.lastTick + delta;
+  replay.nextKey = key;
+  replay.lastTick = replay.nextTick;
+}
+
+/// Opens a recording for playback and takes over its color generator seed
+bool replayStartPlayback(char const *path) {
+  replayHeader header;
+  replay.playback = fopen(path, "rb");
+  if (!replay.playback) {
+    fprintf(stderr, "ERROR: could not open recording %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  if (fread(&header, sizeof(header), 1, replay.playback) != 1 ||
+      header.magic != REPLAY_MAGIC || header.version != REPLAY_VERSION) {
+    fprintf(stderr, "ERROR: %s is not a stetris recording\n", path);
+    return false;
+  }
+  replay.seed = header.seed;
+  replayReadNext();
+  return true;
+}
+
+int replayPlaybackKey() {
+  if (replay.exhausted || replay.nextTick != replay.tick)
+    return 0;
+  int const key = replay.nextKey;
+  replayReadNext();
+  return key;
+}
+
+/// Writes the playfield and the game statistics to stderr if a dump was requested for this tick
+void replayDump() {
+  for (unsigned int i = 0; i < replay.numDumps; i++) {
+    if (replay.dumps[i] != replay.tick)
+      continue;
+    fprintf(stderr, "tick %lu: tiles %u rows %u score %u level %u state %u\n",
+            replay.tick, game.tiles, game.rows, game.score, game.level, game.state);
+    for (unsigned int y = 0; y < game.grid.y; y++) {
+      for (unsigned int x = 0; x < game.grid.x; x++) {
+        coord const checkTile = {x, y};
+        fputc(tileOccupied(checkTile) ? '#' : '.', stderr);
+      }
+      fputc('\n', stderr);
+    }
+    return;
+  }
+}
+
+/// FNV-1a over the game statistics and the playfield, to compare a playback with its recording
+uint64_t replayChecksum() {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  unsigned int const stats[] = {game.tiles, game.rows, game.score, game.level, game.state};
+  for (unsigned int i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+    hash = (hash ^ stats[i]) * 0x100000001b3ULL;
+  }
+  for (unsigned int y = 0; y < game.grid.y; y++) {
+    for (unsigned int x = 0; x < game.grid.x; x++) {
+      tile const *t = &game.playfield[y][x];
+      hash = (hash ^ (t->occupied ? (uint32_t) t->color : 0xffffffffu)) * 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+void replayFinish() {
+  if (replay.record || replay.playback) {
+    fprintf(stderr, "ticks %lu tiles %u rows %u score %u level %u checksum %016llx\n",
+            replay.tick, game.tiles, game.rows, game.score, game.level,
+            (unsigned long long) replayChecksum());
+  }
+  if (replay.record)
+    fclose(replay.record);
+  if (replay.playback)
+    fclose(replay.playback);
+}
+
+void usage(char const *name) {
+  fprintf(stderr,
+          "Usage: %s [-r recording] [-p recording [-f]] [-s seed] [-d tick]...\n"
+          "  -r FILE  record the session to FILE\n"
+          "  -p FILE  play back the session recorded in FILE\n"
+          "  -f       play back as fast as possible without rendering\n"
+          "  -s SEED  seed of the tile colors (default 1)\n"
+          "  -d TICK  dump the playfield to stderr at TICK, may be repeated\n",
+          name);
+}
+
 
 inline unsigned long uSecFromTimespec(struct timespec const ts) {
   return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
 }
 
 int main(int argc, char **argv) {
-  (void) argc;
-  (void) argv;
+  char const *recordPath = NULL;
+  char const *playbackPath = NULL;
+  int opt;
+
+  replay.seed = 1;
+  while ((opt = getopt(argc, argv, "r:p:fs:d:")) != -1) {
+    switch (opt) {
+    case 'r':
+      recordPath = optarg;
+      break;
+    case 'p':
+      playbackPath = optarg;
+      break;
+    case 'f':
+      replay.fast = true;
+      break;
+    case 's':
+      replay.seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      if (replay.numDumps == REPLAY_MAX_DUMPS) {
+        fprintf(stderr, "ERROR: at most %d dumps\n", REPLAY_MAX_DUMPS);
+        return 1;
+      }
+      replay.dumps[replay.numDumps++] = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay.fast && !playbackPath) {
+    fprintf(stderr, "ERROR: -f is only supported for playback\n");
+    return 1;
+  }
+  // The seed of a playback comes from the recording, so it is opened first
+  if (playbackPath && !replayStartPlayback(playbackPath))
+    return 1;
+  if (recordPath && !replayStartRecording(recordPath))
+    return 1;
+  // xorshift gets stuck at 0
+  randState = replay.seed ? replay.seed : 1;
+
   // This sets the stdin in a special state where each
   // keyboard press is directly flushed to the stdin and additionally
   // not outputted to the stdout
-  {
+  if (!replay.fast) {
     struct termios ttystate;
     tcgetattr(STDIN_FILENO, &ttystate);
     ttystate.c_lflag &= ~(ICANON | ECHO);
@@ -511,30 +782,45 @@ int main(int argc, char **argv) {
   // Start with gameOver
   gameOver();
 
-  if (!initializeSenseHat()) {
-    fprintf(stderr, "ERROR: could not initilize sense hat\n");
-    return 1;
+  // A playback can run without the sense hat, then it only renders to the console
+  if (!replay.fast && !initializeSenseHat()) {
+    if (!playbackPath) {
+      fprintf(stderr, "ERROR: could not initilize sense hat\n");
+      return 1;
+    }
+    framebuffer = NULL;
   };
 
   // Clear console, render first time
-  fprintf(stdout, "\033[H\033[J");
-  renderConsole(true);
-  renderSenseHatMatrix(true);
+  if (!replay.fast) {
+    fprintf(stdout, "\033[H\033[J");
+    renderConsole(true);
+    renderSenseHatMatrix(true);
+  }
 
-  while (true) {
+  while (!(replay.playback && replay.exhausted)) {
     struct timeval sTv, eTv;
     gettimeofday(&sTv, NULL);
 
-    int key = readSenseHatJoystick();
+    int key = replay.playback ? replayPlaybackKey() : readSenseHatJoystick();
     // if (!key)
     //   key = readKeyboard();
+    replayRecordKey(key);
     if (key == KEY_ENTER)
       break;
 
     bool playfieldChanged = sTetris(key);
 
-    renderConsole(playfieldChanged);
-    renderSenseHatMatrix(playfieldChanged);
+    if (!replay.fast) {
+      renderConsole(playfieldChanged);
+      renderSenseHatMatrix(playfieldChanged);
+    }
+    replayDump();
+    replay.tick++;
+    if (replay.fast) {
+      game.tick = (game.tick + 1) % game.nextGameTick;
+      continue;
+    }
 
     // Wait for next tick
     gettimeofday(&eTv, NULL);
@@ -544,6 +830,7 @@ int main(int argc, char **argv) {
     }
     game.tick = (game.tick + 1) % game.nextGameTick;
   }
+  replayFinish();
   resetMatrix();
   freeSenseHat();
   free(game.playfield);